@@ -0,0 +1,570 @@
+/*
+ * CRITICAL DATABASE READER/WRITER
+ * ===============================
+ * See critical_db.h for the file formats.
+ *
+ * Build next to the generator and link into bots:
+ *   gcc -O3 -c critical_db.c
+ */
+#include "critical_db.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+/* ============== READER ============== */
+/* Stored key of a legacy slot; 8-byte keys are not aligned */
+static inline uint64_t legacy_key_at(const CriticalDb *db, size_t idx) {
+    if (db->key_bytes == 8) {
+        uint64_t key;
+        memcpy(&key, db->legacy_keys + idx * 8, sizeof(key));
+        return key;
+    }
+    uint32_t key;
+    memcpy(&key, db->legacy_keys + idx * 4, sizeof(key));
+    return key;
+}
+static bool cdb_open_legacy(CriticalDb *db) {
+    if (db->size < 12) return false;
+    const uint8_t *h = db->base;
+    if ((h[4] != 4 && h[4] != 8) || h[5] != 1) return false;
+    db->format = CDB_FORMAT_LEGACY;
+    db->width = h[0];
+    db->height = h[1];
+    db->min_ply = h[2];
+    db->max_ply = h[3];
+    db->flags = h[6];
+    db->key_bits = db->width * (db->height + 1);
+    db->key_bytes = h[4];
+    memcpy(&db->table_size, h + 8, sizeof(uint32_t));
+    size_t slot_bytes = (size_t)db->key_bytes + 1;
+    if (db->table_size == 0 || db->size < 12 + (size_t)db->table_size * slot_bytes) return false;
+    db->legacy_keys = h + 12;
+    db->legacy_values = h + 12 + (size_t)db->table_size * db->key_bytes;
+    for (uint32_t i = 0; i < db->table_size; i++) {
+        if (legacy_key_at(db, i) != 0) db->count++;
+    }
+    return true;
+}
+static bool cdb_open_sorted(CriticalDb *db) {
+    CdbHeader h;
+    if (db->size < sizeof(h)) return false;
+    memcpy(&h, db->base, sizeof(h));
+    if (h.version != CDB_VERSION_SORTED) return false;
+    if (h.value_bytes != ((h.flags & CDB_FLAG_EXTENDED) ? 4 : 1)) return false;
+    if (h.key_bits == 0 || h.key_bits > 64 || h.index_bits > h.key_bits) return false;
+    if (h.file_size != db->size) return false;
+    uint64_t index_bytes = ((1ULL << h.index_bits) + 1) * sizeof(uint32_t);
+    if (h.index_offset % CDB_PAGE || h.keys_offset % CDB_PAGE || h.values_offset % CDB_PAGE
+        || h.index_offset + index_bytes > h.file_size
+        || h.keys_offset + h.count * sizeof(uint64_t) > h.file_size
+        || h.values_offset + h.count * h.value_bytes > h.file_size) {
+        return false;
+    }
+    db->format = CDB_FORMAT_SORTED;
+    db->width = h.width;
+    db->height = h.height;
+    db->min_ply = h.min_ply;
+    db->max_ply = h.max_ply;
+    db->flags = h.flags;
+    db->key_bits = h.key_bits;
+    db->count = h.count;
+    db->index_bits = h.index_bits;
+    db->value_bytes = h.value_bytes;
+    db->index = (const uint32_t *)(db->base + h.index_offset);
+    db->keys = (const uint64_t *)(db->base + h.keys_offset);
+    db->values = db->base + h.values_offset;
+    return db->index[(size_t)1 << h.index_bits] == h.count;
+}
+static bool cdb_open_compact(CriticalDb *db) {
+    CdbHeader h;
+    if (db->size < sizeof(h)) return false;
+    memcpy(&h, db->base, sizeof(h));
+    if (h.value_bits != CDB_VALUE_BITS || h.key_bits == 0 || h.key_bits > 64
+        || h.low_bits > h.key_bits || h.index_bits >= 32 || h.file_size != db->size) {
+        return false;
+    }
+    uint64_t high_values = 1ULL << (h.key_bits - h.low_bits);
+    uint64_t samples = (high_values >> h.index_bits) + 1;
+    if (h.key_bits - h.low_bits >= 40 || h.high_length != h.count + high_values
+        || h.index_offset % CDB_PAGE || h.keys_offset % CDB_PAGE
+        || h.lows_offset % CDB_PAGE || h.values_offset % CDB_PAGE
+        || h.index_offset + samples * sizeof(uint32_t) > h.file_size
+        || h.keys_offset + (h.high_length / 64 + 1) * 8 > h.file_size
+        || h.lows_offset + (h.count * h.low_bits / 64 + 1) * 8 > h.file_size
+        || h.values_offset + (h.count * h.value_bits / 64 + 1) * 8 > h.file_size) {
+        return false;
+    }
+    db->format = CDB_FORMAT_COMPACT;
+    db->width = h.width;
+    db->height = h.height;
+    db->min_ply = h.min_ply;
+    db->max_ply = h.max_ply;
+    db->flags = h.flags;
+    db->key_bits = h.key_bits;
+    db->count = h.count;
+    db->index_bits = h.index_bits;
+    db->low_bits = h.low_bits;
+    db->high_length = h.high_length;
+    db->index = (const uint32_t *)(db->base + h.index_offset);
+    db->high = (const uint64_t *)(db->base + h.keys_offset);
+    db->lows = (const uint64_t *)(db->base + h.lows_offset);
+    db->packed_values = (const uint64_t *)(db->base + h.values_offset);
+    return true;
+}
+bool cdb_open(CriticalDb *db, const char *path) {
+    memset(db, 0, sizeof(*db));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s!\n", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Failed to read %s!\n", path);
+        close(fd);
+        return false;
+    }
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s!\n", path);
+        return false;
+    }
+    db->base = (const uint8_t *)base;
+    db->size = (size_t)st.st_size;
+
+    bool ok;
+    if (db->size >= sizeof(CdbHeader) && memcmp(db->base, CDB_MAGIC, 8) == 0) {
+        uint32_t version;
+        memcpy(&version, db->base + 8, sizeof(version));
+        ok = version == CDB_VERSION_COMPACT ? cdb_open_compact(db) : cdb_open_sorted(db);
+    } else {
+        ok = cdb_open_legacy(db);
+    }
+    if (!ok) {
+        fprintf(stderr, "%s is not a valid critical database!\n", path);
+        cdb_close(db);
+        return false;
+    }
+    return true;
+}
+void cdb_close(CriticalDb *db) {
+    if (db->base) munmap((void *)db->base, db->size);
+    memset(db, 0, sizeof(*db));
+}
+/* width (<= 64) bits starting at bit pos; arrays carry a trailing zero
+ * word so the second read never leaves the mapping */
+static inline uint64_t get_bits(const uint64_t *a, uint64_t pos, unsigned width) {
+    if (width == 0) return 0;
+    uint64_t word = pos >> 6;
+    unsigned shift = pos & 63;
+    uint64_t bits = a[word] >> shift;
+    if (shift + width > 64) bits |= a[word + 1] << (64 - shift);
+    return width == 64 ? bits : bits & ((1ULL << width) - 1);
+}
+/* What a probe is computed from: the slot key itself for the legacy
+ * format, the mixed key for the others */
+static inline uint64_t probe_key(const CriticalDb *db, uint64_t key) {
+    return db->format == CDB_FORMAT_LEGACY ? key : cdb_mix_key(key, db->key_bits);
+}
+static inline size_t sorted_bucket(const CriticalDb *db, uint64_t mixed) {
+    return db->index_bits ? mixed >> (db->key_bits - db->index_bits) : 0;
+}
+static inline uint64_t compact_high(const CriticalDb *db, uint64_t mixed) {
+    return db->low_bits == 64 ? 0 : mixed >> db->low_bits;
+}
+static int lookup_compact(const CriticalDb *db, uint64_t mixed) {
+    if (db->count == 0) return -1;
+    uint64_t high = compact_high(db, mixed);
+    uint64_t low = db->low_bits == 64 ? mixed : mixed & ((1ULL << db->low_bits) - 1);
+    
+    /* From the sample, skip the zeros that end the preceding high parts */
+    uint64_t pos = db->index[high >> db->index_bits];
+    uint64_t skip = high & ((1ULL << db->index_bits) - 1);
+    while (skip > 0) {
+        unsigned shift = pos & 63;
+        uint64_t zeros = ~db->high[pos >> 6] >> shift;
+        uint64_t count = (uint64_t)__builtin_popcountll(zeros);
+        if (count < skip) {
+            skip -= count;
+            pos += 64 - shift;
+            continue;
+        }
+        for (; skip > 1; skip--) zeros &= zeros - 1;
+        pos += (uint64_t)__builtin_ctzll(zeros) + 1;
+        break;
+    }
+    
+    /* Each one bit is an element with this high part, lows ascending */
+    while (pos < db->high_length && (db->high[pos >> 6] >> (pos & 63) & 1)) {
+        uint64_t i = pos - high;
+        uint64_t l = get_bits(db->lows, i * db->low_bits, db->low_bits);
+        if (l >= low) {
+            if (l != low) return -1;
+            return (int)get_bits(db->packed_values, i * CDB_VALUE_BITS, CDB_VALUE_BITS);
+        }
+        pos++;
+    }
+    return -1;
+}
+/* Entry index of a mixed key in the sorted format, or -1 */
+static int64_t sorted_find(const CriticalDb *db, uint64_t mixed) {
+    size_t bucket = sorted_bucket(db, mixed);
+    for (uint32_t i = db->index[bucket], end = db->index[bucket + 1]; i < end; i++) {
+        if (db->keys[i] >= mixed) return db->keys[i] == mixed ? (int64_t)i : -1;
+    }
+    return -1;
+}
+static inline uint32_t extended_at(const CriticalDb *db, size_t i) {
+    uint32_t value;
+    memcpy(&value, db->values + i * 4, sizeof(value));
+    return value;
+}
+static int lookup_sorted(const CriticalDb *db, uint64_t mixed) {
+    int64_t i = sorted_find(db, mixed);
+    if (i < 0) return -1;
+    if (db->value_bytes == 1) return db->values[i];
+    int col = (extended_at(db, (size_t)i) >> 8) & 0xFF;
+    return col == CDB_NO_COLUMN ? -1 : col;
+}
+/* Legacy: linear probing, exact only with 8-byte keys */
+static int lookup_legacy(const CriticalDb *db, uint64_t key) {
+    uint64_t stored = cdb_legacy_stored(key, db->key_bytes);
+    size_t idx = cdb_legacy_slot(key, db->table_size);
+    uint64_t k;
+    while ((k = legacy_key_at(db, idx)) != 0) {
+        if (k == stored) return db->legacy_values[idx];
+        idx = (idx + 1) % db->table_size;
+    }
+    return -1;
+}
+static inline int lookup_probe(const CriticalDb *db, uint64_t probe) {
+    switch (db->format) {
+    case CDB_FORMAT_COMPACT: return lookup_compact(db, probe);
+    case CDB_FORMAT_SORTED: return lookup_sorted(db, probe);
+    default: return lookup_legacy(db, probe);
+    }
+}
+int cdb_lookup_key(const CriticalDb *db, uint64_t key) {
+    return lookup_probe(db, probe_key(db, key));
+}
+/* Canonical form of a position key; *mirrored tells whether the stored
+ * column must be reflected back */
+static inline uint64_t canonical_of(const CriticalDb *db, uint64_t key, bool *mirrored) {
+    *mirrored = false;
+    if (db->flags & CDB_FLAG_MIRRORED) {
+        uint64_t m = cdb_mirror_key(key, db->width, db->height);
+        if (m < key) {
+            *mirrored = true;
+            return m;
+        }
+    }
+    return key;
+}
+/* First cache lines a probe touches: the legacy slot, the sorted
+ * bucket's index entry, the compact sample */
+static inline void prefetch_first(const CriticalDb *db, uint64_t probe) {
+    if (db->format == CDB_FORMAT_LEGACY) {
+        size_t idx = cdb_legacy_slot(probe, db->table_size);
+        __builtin_prefetch(db->legacy_keys + idx * db->key_bytes);
+        __builtin_prefetch(db->legacy_values + idx);
+    } else if (db->format == CDB_FORMAT_SORTED) {
+        __builtin_prefetch(db->index + sorted_bucket(db, probe));
+    } else if (db->count > 0) {
+        __builtin_prefetch(db->index + (compact_high(db, probe) >> db->index_bits));
+    }
+}
+/* Second level, once the first lines have (likely) arrived: the keys
+ * and values of a sorted bucket; the high bits after a compact sample
+ * and the lows and values near the expected element */
+static inline void prefetch_second(const CriticalDb *db, uint64_t probe) {
+    if (db->format == CDB_FORMAT_SORTED) {
+        uint32_t first = db->index[sorted_bucket(db, probe)];
+        __builtin_prefetch(db->keys + first);
+        __builtin_prefetch(db->values + (size_t)first * db->value_bytes);
+    } else if (db->format == CDB_FORMAT_COMPACT && db->count > 0) {
+        uint64_t high = compact_high(db, probe);
+        uint64_t sample_high = high >> db->index_bits << db->index_bits;
+        uint64_t pos = db->index[high >> db->index_bits];
+        uint64_t i = pos - sample_high + (high - sample_high) * db->count / (db->high_length - db->count);
+        __builtin_prefetch(db->high + (pos >> 6));
+        __builtin_prefetch(db->lows + i * db->low_bits / 64);
+        __builtin_prefetch(db->packed_values + i * CDB_VALUE_BITS / 64);
+    }
+}
+void cdb_lookup_batch(const CriticalDb *db, const uint64_t *keys, size_t n, int *out) {
+    uint64_t probe[CDB_BATCH];
+    bool mirrored[CDB_BATCH];
+    for (size_t base = 0; base < n; base += CDB_BATCH) {
+        size_t m = n - base < CDB_BATCH ? n - base : CDB_BATCH;
+        for (size_t i = 0; i < m; i++) {
+            probe[i] = probe_key(db, canonical_of(db, keys[base + i], &mirrored[i]));
+            prefetch_first(db, probe[i]);
+        }
+        for (size_t i = 0; i < m; i++) prefetch_second(db, probe[i]);
+        for (size_t i = 0; i < m; i++) {
+            int col = lookup_probe(db, probe[i]);
+            out[base + i] = col >= 0 && mirrored[i] ? db->width - 1 - col : col;
+        }
+    }
+}
+int cdb_lookup(const CriticalDb *db, uint64_t current, uint64_t mask) {
+    bool mirrored;
+    uint64_t key = canonical_of(db, cdb_position_key(current, mask), &mirrored);
+    int col = cdb_lookup_key(db, key);
+    return col >= 0 && mirrored ? db->width - 1 - col : col;
+}
+bool cdb_lookup_extended(const CriticalDb *db, uint64_t current, uint64_t mask,
+    CdbExtended *out) {
+    if (db->format != CDB_FORMAT_SORTED || db->value_bytes != 4) return false;
+    bool mirrored;
+    uint64_t key = canonical_of(db, cdb_position_key(current, mask), &mirrored);
+    int64_t i = sorted_find(db, cdb_mix_key(key, db->key_bits));
+    if (i < 0) return false;
+    
+    uint32_t value = extended_at(db, (size_t)i);
+    out->score = (int8_t)(value & 0xFF);
+    out->winning_col = (value >> 8) & 0xFF;
+    out->classes = value >> 16;
+    if (out->winning_col == CDB_NO_COLUMN) out->winning_col = -1;
+    if (mirrored) {
+        if (out->winning_col >= 0) out->winning_col = db->width - 1 - out->winning_col;
+        out->classes = cdb_mirror_classes(out->classes, db->width);
+    }
+    return true;
+}
+/* ============== WRITER ============== */
+typedef struct {
+    uint64_t key;
+    uint32_t value;
+} CdbPair;
+static int compare_pair(const void *a, const void *b) {
+    uint64_t ka = ((const CdbPair *)a)->key;
+    uint64_t kb = ((const CdbPair *)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+static uint64_t page_align(uint64_t offset) {
+    return (offset + CDB_PAGE - 1) & ~(uint64_t)(CDB_PAGE - 1);
+}
+/* Write len bytes then zero padding up to the next page boundary */
+static bool write_padded(FILE *f, const void *data, size_t len) {
+    static const uint8_t zeros[CDB_PAGE];
+    if (len && fwrite(data, 1, len, f) != len) return false;
+    size_t pad = (size_t)(page_align(len) - len);
+    return fwrite(zeros, 1, pad, f) == pad;
+}
+/* Mix the keys and sort them together with their values, which are
+ * value_bytes (1 or 4) each */
+static bool sort_mixed(const uint64_t *keys, const void *values, unsigned value_bytes,
+    size_t n, int key_bits, uint64_t **sorted_keys, uint8_t **sorted_values) {
+    CdbPair *pairs = (CdbPair *)malloc((n ? n : 1) * sizeof(CdbPair));
+    *sorted_keys = (uint64_t *)malloc((n ? n : 1) * sizeof(uint64_t));
+    *sorted_values = (uint8_t *)malloc((n ? n : 1) * value_bytes);
+    if (!pairs || !*sorted_keys || !*sorted_values) {
+        fprintf(stderr, "Failed to allocate database entries!\n");
+        free(pairs);
+        free(*sorted_keys);
+        free(*sorted_values);
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        pairs[i].key = cdb_mix_key(keys[i], key_bits);
+        pairs[i].value = value_bytes == 1
+            ? ((const uint8_t *)values)[i] : ((const uint32_t *)values)[i];
+    }
+    qsort(pairs, n, sizeof(CdbPair), compare_pair);
+    for (size_t i = 0; i < n; i++) {
+        (*sorted_keys)[i] = pairs[i].key;
+        if (value_bytes == 1) {
+            (*sorted_values)[i] = (uint8_t)pairs[i].value;
+        } else {
+            memcpy(*sorted_values + i * 4, &pairs[i].value, 4);
+        }
+    }
+    free(pairs);
+    return true;
+}
+static void header_init(CdbHeader *h, const CdbMeta *meta, uint32_t version, size_t n) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, CDB_MAGIC, 8);
+    h->version = version;
+    h->width = (uint8_t)meta->width;
+    h->height = (uint8_t)meta->height;
+    h->min_ply = (uint8_t)meta->min_ply;
+    h->max_ply = (uint8_t)meta->max_ply;
+    h->flags = (uint8_t)meta->flags;
+    h->key_bits = (uint8_t)(meta->width * (meta->height + 1));
+    h->count = n;
+    h->index_offset = CDB_PAGE;
+}
+/* Write the header page and the sections, each padded to a page. The
+ * file is written beside the target and renamed, so readers that have
+ * the old file mapped never see a partial one. */
+static bool write_sections(const char *path, const CdbHeader *h,
+    const void *const *sections, const size_t *lens, int count) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s for writing!\n", tmp);
+        return false;
+    }
+    bool ok = write_padded(f, h, sizeof(*h));
+    for (int i = 0; i < count; i++) ok = ok && write_padded(f, sections[i], lens[i]);
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0) ok = false;
+    if (ok && rename(tmp, path) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "Failed to write %s!\n", path);
+        remove(tmp);
+    }
+    return ok;
+}
+static bool write_sorted(const char *path, const CdbMeta *meta, const uint64_t *keys,
+    const void *values, unsigned value_bytes, size_t n) {
+    if (n >= UINT32_MAX) {
+        fprintf(stderr, "Too many entries for the sorted format!\n");
+        return false;
+    }
+    int key_bits = meta->width * (meta->height + 1);
+    unsigned index_bits = 0;
+    while (index_bits < (unsigned)key_bits && index_bits < 32
+        && ((uint64_t)CDB_BUCKET_TARGET << index_bits) < n) {
+        index_bits++;
+    }
+    size_t buckets = (size_t)1 << index_bits;
+
+    uint64_t *sorted_keys;
+    uint8_t *sorted_values;
+    if (!sort_mixed(keys, values, value_bytes, n, key_bits, &sorted_keys, &sorted_values)) {
+        return false;
+    }
+    uint32_t *index = (uint32_t *)calloc(buckets + 1, sizeof(uint32_t));
+    if (!index) {
+        fprintf(stderr, "Failed to allocate sorted database!\n");
+        free(sorted_keys);
+        free(sorted_values);
+        return false;
+    }
+
+    /* Count entries per bucket, then prefix sums give the bucket starts */
+    for (size_t i = 0; i < n; i++) {
+        size_t bucket = index_bits ? sorted_keys[i] >> (key_bits - index_bits) : 0;
+        index[bucket + 1]++;
+    }
+    for (size_t i = 0; i < buckets; i++) index[i + 1] += index[i];
+
+    CdbHeader h;
+    header_init(&h, meta, CDB_VERSION_SORTED, n);
+    h.value_bytes = (uint8_t)value_bytes;
+    if (value_bytes == 4) h.flags |= CDB_FLAG_EXTENDED;
+    h.index_bits = (uint8_t)index_bits;
+    h.keys_offset = h.index_offset + page_align((buckets + 1) * sizeof(uint32_t));
+    h.values_offset = h.keys_offset + page_align(n * sizeof(uint64_t));
+    h.file_size = h.values_offset + page_align(n * value_bytes);
+
+    const void *sections[] = {index, sorted_keys, sorted_values};
+    size_t lens[] = {(buckets + 1) * sizeof(uint32_t), n * sizeof(uint64_t), n * value_bytes};
+    bool ok = write_sections(path, &h, sections, lens, 3);
+
+    free(index);
+    free(sorted_keys);
+    free(sorted_values);
+    return ok;
+}
+bool cdb_write_sorted(const char *path, const CdbMeta *meta,
+    const uint64_t *keys, const uint8_t *values, size_t n) {
+    return write_sorted(path, meta, keys, values, 1, n);
+}
+bool cdb_write_extended(const char *path, const CdbMeta *meta,
+    const uint64_t *keys, const uint32_t *values, size_t n) {
+    return write_sorted(path, meta, keys, values, 4, n);
+}
+/* Store width bits at bit pos of a zeroed array */
+static inline void put_bits(uint64_t *a, uint64_t pos, unsigned width, uint64_t bits) {
+    if (width == 0) return;
+    uint64_t word = pos >> 6;
+    unsigned shift = pos & 63;
+    a[word] |= bits << shift;
+    if (shift + width > 64) a[word + 1] |= bits >> (64 - shift);
+}
+bool cdb_write_compact(const char *path, const CdbMeta *meta,
+    const uint64_t *keys, const uint8_t *values, size_t n) {
+    int key_bits = meta->width * (meta->height + 1);
+
+    /* Elias-Fano split: low_bits = floor(log2(2^key_bits / n)) */
+    unsigned low_bits = (unsigned)key_bits;
+    if (n > 0) {
+        low_bits = 0;
+        while (low_bits + 1 <= (unsigned)key_bits
+            && (uint64_t)n <= (1ULL << (key_bits - low_bits - 1))) {
+            low_bits++;
+        }
+    }
+    uint64_t high_values = 1ULL << (key_bits - low_bits);
+    uint64_t high_length = n + high_values;
+    if (high_length >= UINT32_MAX) {
+        fprintf(stderr, "Too many entries for the compact format!\n");
+        return false;
+    }
+    size_t num_samples = (size_t)(high_values >> CDB_SAMPLE_SHIFT) + 1;
+    size_t high_words = high_length / 64 + 1;
+    size_t low_words = (size_t)((uint64_t)n * low_bits / 64) + 1;
+    size_t value_words = (size_t)((uint64_t)n * CDB_VALUE_BITS / 64) + 1;
+
+    uint64_t *sorted_keys;
+    uint8_t *sorted_values;
+    if (!sort_mixed(keys, values, 1, n, key_bits, &sorted_keys, &sorted_values)) return false;
+    uint32_t *samples = (uint32_t *)calloc(num_samples, sizeof(uint32_t));
+    uint64_t *high = (uint64_t *)calloc(high_words, sizeof(uint64_t));
+    uint64_t *lows = (uint64_t *)calloc(low_words, sizeof(uint64_t));
+    uint64_t *packed = (uint64_t *)calloc(value_words, sizeof(uint64_t));
+    bool ok = samples && high && lows && packed;
+    if (!ok) fprintf(stderr, "Failed to allocate compact database!\n");
+
+    /* samples[j]: first bit of high part j << CDB_SAMPLE_SHIFT, i.e. the
+     * elements before it plus the zeros ending each earlier high part */
+    size_t next = 0;
+    for (size_t j = 0; ok && j < num_samples; j++) {
+        uint64_t first_high = (uint64_t)j << CDB_SAMPLE_SHIFT;
+        while (next < n && (low_bits == 64 ? 0 : sorted_keys[next] >> low_bits) < first_high) next++;
+        samples[j] = (uint32_t)(next + first_high);
+    }
+    for (size_t i = 0; ok && i < n; i++) {
+        uint64_t key = sorted_keys[i];
+        uint64_t key_high = low_bits == 64 ? 0 : key >> low_bits;
+        high[(key_high + i) >> 6] |= 1ULL << ((key_high + i) & 63);
+        put_bits(lows, (uint64_t)i * low_bits, low_bits,
+            low_bits == 64 ? key : key & ((1ULL << low_bits) - 1));
+        put_bits(packed, (uint64_t)i * CDB_VALUE_BITS, CDB_VALUE_BITS, sorted_values[i]);
+    }
+
+    if (ok) {
+        CdbHeader h;
+        header_init(&h, meta, CDB_VERSION_COMPACT, n);
+        h.index_bits = CDB_SAMPLE_SHIFT;
+        h.low_bits = (uint8_t)low_bits;
+        h.value_bits = CDB_VALUE_BITS;
+        h.high_length = high_length;
+        h.keys_offset = h.index_offset + page_align(num_samples * sizeof(uint32_t));
+        h.lows_offset = h.keys_offset + page_align(high_words * sizeof(uint64_t));
+        h.values_offset = h.lows_offset + page_align(low_words * sizeof(uint64_t));
+        h.file_size = h.values_offset + page_align(value_words * sizeof(uint64_t));
+
+        const void *sections[] = {samples, high, lows, packed};
+        size_t lens[] = {num_samples * sizeof(uint32_t), high_words * sizeof(uint64_t),
+            low_words * sizeof(uint64_t), value_words * sizeof(uint64_t)};
+        ok = write_sections(path, &h, sections, lens, 4);
+    }
+
+    free(samples);
+    free(high);
+    free(lows);
+    free(packed);
+    free(sorted_keys);
+    free(sorted_values);
+    return ok;
+}
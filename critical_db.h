@@ -0,0 +1,202 @@
+/*
+ * CRITICAL DATABASE FORMAT
+ * ========================
+ * Shared by the generator (writer) and bots (readers) so the on-disk
+ * layout, key mixing and slot computation cannot drift apart.
+ *
+ * Three formats exist; cdb_open() tells them apart by the first bytes.
+ *
+ * LEGACY (version 1, the original critical.db):
+ *   uint8_t  header[8]   width, height, min_ply, max_ply, key_bytes,
+ *                        value_bytes = 1, flags, 0
+ *   uint32_t table_size  (prime)
+ *   keys[table_size]     key_bytes 4: uint32_t key >> 16, which can match
+ *                        an unrelated key further along the probe chain;
+ *                        key_bytes 8: uint64_t key (unaligned), exact.
+ *                        0 = empty slot
+ *   uint8_t  values[table_size]   winning column
+ *   Slot is key % table_size, then linear probing.
+ *
+ * SORTED (version 2), designed to be mmap'ed read-only and shared:
+ *   CdbHeader            padded to one page
+ *   uint32_t index[2^index_bits + 1]   page aligned
+ *   uint64_t keys[count]               page aligned, ascending
+ *   values[count]                      page aligned, value_bytes each
+ *   keys[] holds cdb_mix_key(key), a bijection on key_bits bits, so the
+ *   keys are uniform and exact. Bucket i = mixed >> (key_bits -
+ *   index_bits) spans keys[index[i] .. index[i + 1]), about
+ *   CDB_BUCKET_TARGET entries: one index read and one short scan.
+ *   value_bytes 1: the winning column. value_bytes 4, flag
+ *   CDB_FLAG_EXTENDED: an extended record (see cdb_pack_extended) for
+ *   every analyzed position, critical or not.
+ *
+ * COMPACT (version 3), Elias-Fano coded, queried in place:
+ *   CdbHeader            padded to one page
+ *   uint32_t samples[(2^(key_bits - low_bits) >> index_bits) + 1]
+ *   uint64_t high[]      high_length bits: element i with high part
+ *                        h = mixed >> low_bits sets bit h + i
+ *   uint64_t lows[]      low_bits bits per element, packed
+ *   uint64_t values[]    value_bits (3) bits per element, packed
+ *   Each section is page aligned and followed by a zero word. samples[j]
+ *   is the bit in high[] where high part j << index_bits starts, so a
+ *   lookup skips fewer than 2^index_bits zeros from there, then compares
+ *   the low parts of that high part's run. About 2 + low_bits + 3 bits
+ *   per entry, exact keys, no false positives.
+ *
+ * All keys are mirror-canonical when flags has CDB_FLAG_MIRRORED:
+ * cdb_lookup() canonicalizes and maps the column back itself.
+ */
+#ifndef CRITICAL_DB_H
+#define CRITICAL_DB_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#define CDB_FLAG_MIRRORED 0x01   /* Keys are min(key, mirror(key)) */
+#define CDB_FLAG_EXTENDED 0x02   /* Values are extended records */
+#define CDB_MAGIC "C4CRITDB"
+#define CDB_VERSION_SORTED 2
+#define CDB_VERSION_COMPACT 3
+#define CDB_PAGE 4096
+#define CDB_BUCKET_TARGET 8
+#define CDB_SAMPLE_SHIFT 6
+#define CDB_VALUE_BITS 3
+#define CDB_BATCH 32             /* Probes kept in flight by cdb_lookup_batch */
+enum { CDB_FORMAT_LEGACY = 1, CDB_FORMAT_SORTED = 2, CDB_FORMAT_COMPACT = 3 };
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint8_t width, height, min_ply, max_ply;
+    uint8_t flags, key_bits, value_bytes, index_bits;
+    uint8_t low_bits, value_bits, reserved[2];  /* Compact only */
+    uint64_t count;
+    uint64_t index_offset;   /* Sorted: bucket index; compact: samples */
+    uint64_t keys_offset;    /* Sorted: keys; compact: high bits */
+    uint64_t values_offset;
+    uint64_t file_size;
+    uint64_t lows_offset;    /* Compact only */
+    uint64_t high_length;    /* Compact only, in bits */
+} CdbHeader;
+/* An open database; all pointers point into the read-only mapping */
+typedef struct {
+    int format;
+    int width, height, min_ply, max_ply, flags, key_bits;
+    uint64_t count;
+    const uint8_t *base;
+    size_t size;
+    /* Sorted format */
+    unsigned index_bits;
+    unsigned value_bytes;
+    const uint32_t *index;
+    const uint64_t *keys;
+    const uint8_t *values;
+    /* Compact format (index holds the samples) */
+    unsigned low_bits;
+    uint64_t high_length;
+    const uint64_t *high;
+    const uint64_t *lows;
+    const uint64_t *packed_values;
+    /* Legacy format */
+    uint32_t table_size;
+    int key_bytes;
+    const uint8_t *legacy_keys;
+    const uint8_t *legacy_values;
+} CriticalDb;
+/* ============== KEYS ============== */
+/* Position key as used by the generator: current + mask */
+static inline uint64_t cdb_position_key(uint64_t current, uint64_t mask) {
+    return current + mask;
+}
+/* Reflect a key left-right (column c <-> width - 1 - c) */
+static inline uint64_t cdb_mirror_key(uint64_t key, int width, int height) {
+    uint64_t col_bits = (1ULL << (height + 1)) - 1;
+    uint64_t r = 0;
+    for (int col = 0; col < width; col++) {
+        r |= ((key >> (col * (height + 1))) & col_bits) << ((width - 1 - col) * (height + 1));
+    }
+    return r;
+}
+/* Bijective mix of a key_bits-bit key: spreads keys uniformly so a
+ * sorted array of them can be indexed by their top bits */
+static inline uint64_t cdb_mix_key(uint64_t key, int key_bits) {
+    uint64_t mask = key_bits >= 64 ? ~0ULL : (1ULL << key_bits) - 1;
+    int shift = (key_bits + 1) / 2;
+    key ^= key >> shift;
+    key = (key * 0xFF51AFD7ED558CCDULL) & mask;
+    key ^= key >> shift;
+    key = (key * 0xC4CEB9FE1A85EC53ULL) & mask;
+    key ^= key >> shift;
+    return key;
+}
+/* Legacy format slot and the key as stored for key_bytes 4 or 8; a
+ * 4-byte key keeps the low 32 bits of key >> 16 (7x6 keys have 33) */
+static inline size_t cdb_legacy_slot(uint64_t key, size_t table_size) {
+    return key % table_size;
+}
+static inline uint64_t cdb_legacy_stored(uint64_t key, int key_bytes) {
+    return key_bytes == 8 ? key : (uint32_t)(key >> 16);
+}
+/* ============== EXTENDED RECORDS ============== */
+/*
+ * uint32_t per position: bits 0-7 exact score (int8, the solver's
+ * convention: positive = side to move wins, larger = sooner), bits 8-15
+ * winning column if the position is critical else CDB_NO_COLUMN, bits
+ * 16-31 a 2-bit class per column (up to 8 columns) for the side to move.
+ */
+#define CDB_NO_COLUMN 0xFF
+enum { CDB_CLASS_ILLEGAL, CDB_CLASS_WIN, CDB_CLASS_DRAW, CDB_CLASS_LOSS };
+typedef struct {
+    int score;
+    int winning_col;     /* -1 if not critical */
+    uint32_t classes;    /* 2 bits per column, cdb_class() */
+} CdbExtended;
+static inline uint32_t cdb_pack_extended(int score, int winning_col, uint32_t classes) {
+    return (uint32_t)(uint8_t)(int8_t)score
+        | (uint32_t)(winning_col < 0 ? CDB_NO_COLUMN : winning_col) << 8
+        | classes << 16;
+}
+static inline int cdb_class(uint32_t classes, int col) {
+    return (classes >> (2 * col)) & 3;
+}
+/* Classes of the mirror image */
+static inline uint32_t cdb_mirror_classes(uint32_t classes, int width) {
+    uint32_t r = 0;
+    for (int col = 0; col < width; col++) {
+        r |= (uint32_t)cdb_class(classes, col) << (2 * (width - 1 - col));
+    }
+    return r;
+}
+/* ============== READER ============== */
+/* Map a database file read-only; returns false (with a message on
+ * stderr) if it cannot be opened or is malformed */
+bool cdb_open(CriticalDb *db, const char *path);
+void cdb_close(CriticalDb *db);
+/* Stored column for a canonical key, or -1 if not critical (for any
+ * format, extended included) */
+int cdb_lookup_key(const CriticalDb *db, uint64_t key);
+/* Winning column for a position (current player's stones, all stones),
+ * or -1; handles mirror canonicalization */
+int cdb_lookup(const CriticalDb *db, uint64_t current, uint64_t mask);
+/* cdb_lookup() for n position keys (current + mask): out[i] is the
+ * winning column for keys[i] or -1. Slots for a whole batch are computed
+ * and prefetched before any is resolved, so the memory latency of the
+ * probes overlaps. */
+void cdb_lookup_batch(const CriticalDb *db, const uint64_t *keys, size_t n, int *out);
+/* Score, classes and critical column of a position in an extended
+ * database, oriented like the position; false if not stored */
+bool cdb_lookup_extended(const CriticalDb *db, uint64_t current, uint64_t mask,
+    CdbExtended *out);
+/* ============== WRITER ============== */
+typedef struct {
+    int width, height, min_ply, max_ply, flags;
+} CdbMeta;
+/* Write a sorted-format database from n canonical keys and their columns
+ * (any order, no duplicates). Returns false on allocation or I/O error. */
+bool cdb_write_sorted(const char *path, const CdbMeta *meta,
+    const uint64_t *keys, const uint8_t *values, size_t n);
+/* Extended records (cdb_pack_extended) in the sorted layout */
+bool cdb_write_extended(const char *path, const CdbMeta *meta,
+    const uint64_t *keys, const uint32_t *values, size_t n);
+/* Same input as cdb_write_sorted, written in the compact format */
+bool cdb_write_compact(const char *path, const CdbMeta *meta,
+    const uint64_t *keys, const uint8_t *values, size_t n);
+#endif
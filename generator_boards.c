@@ -0,0 +1,69 @@
+/*
+ * MULTI-BOARD GENERATOR
+ * =====================
+ * One binary for several board sizes. retrogradgen.c is compiled once per
+ * geometry, so each copy has its own bitboard masks as compile-time
+ * constants, with its main() renamed to generator_WxH; this file picks the
+ * copy named by --board WxH (default 7x6) and hands it the other arguments.
+ *
+ * Build (one object per BOARD() line below):
+ *   gcc -O3 -c critical_db.c
+ *   gcc -O3 -c -DGENERATOR_MAIN=generator_7x6 -o board_7x6.o retrogradgen.c
+ *   gcc -O3 -c -DWIDTH=6 -DHEIGHT=7 -DMIN_PLY=15 -DMAX_PLY=30 \
+ *       -DGENERATOR_MAIN=generator_6x7 -o board_6x7.o retrogradgen.c
+ *   gcc -O3 -c -DWIDTH=8 -DHEIGHT=5 -DMIN_PLY=14 -DMAX_PLY=28 \
+ *       -DGENERATOR_MAIN=generator_8x5 -o board_8x5.o retrogradgen.c
+ *   gcc -O3 -c -DWIDTH=6 -DHEIGHT=5 -DMIN_PLY=10 -DMAX_PLY=20 \
+ *       -DGENERATOR_MAIN=generator_6x5 -o board_6x5.o retrogradgen.c
+ *   gcc -O3 -c -DWIDTH=5 -DHEIGHT=4 -DMIN_PLY=6 -DMAX_PLY=14 \
+ *       -DGENERATOR_MAIN=generator_5x4 -o board_5x4.o retrogradgen.c
+ *   gcc -O3 -o generator generator_boards.c board_*.o critical_db.o -lpthread
+ *
+ *   ./generator [--board WxH] [generator options...]
+ *
+ * A board needs WIDTH <= 8 and WIDTH * (HEIGHT + 1) <= 50 bits (the
+ * position key must fit beside the TT entry fields), so 8x7 and 7x7 are out.
+ * The legacy format's 4-byte keys store key >> 16, which needs at least 48
+ * key bits to stay nonzero and mostly distinct: 6x5 and 5x4 default to
+ * --key-bytes 8 and reject 4 (sorted and compact keys are always exact).
+ */
+#include <stdio.h>
+#include <string.h>
+#define BOARDS(BOARD) BOARD(7, 6) BOARD(6, 7) BOARD(8, 5) BOARD(6, 5) BOARD(5, 4)
+#define DECLARE(w, h) int generator_##w##x##h(int argc, char *argv[]);
+BOARDS(DECLARE)
+typedef struct {
+    int width, height;
+    int (*run)(int argc, char *argv[]);
+} Board;
+#define ENTRY(w, h) {w, h, generator_##w##x##h},
+static const Board boards[] = { BOARDS(ENTRY) };
+int main(int argc, char *argv[]) {
+    int width = 7, height = 6;
+    
+    /* Take --board out of the arguments the generator sees */
+    int out = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--board") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2) {
+                fprintf(stderr, "Invalid board %s (expected WxH)\n", argv[i]);
+                return 1;
+            }
+        } else {
+            argv[out++] = argv[i];
+        }
+    }
+    argv[out] = NULL;
+    
+    for (size_t i = 0; i < sizeof(boards) / sizeof(boards[0]); i++) {
+        if (boards[i].width == width && boards[i].height == height) {
+            return boards[i].run(out, argv);
+        }
+    }
+    fprintf(stderr, "No %dx%d generator in this build; boards:", width, height);
+    for (size_t i = 0; i < sizeof(boards) / sizeof(boards[0]); i++) {
+        fprintf(stderr, " %dx%d", boards[i].width, boards[i].height);
+    }
+    fprintf(stderr, "\n");
+    return 1;
+}
@@ -0,0 +1,36 @@
+/*
+ * SOLVER LIBRARY
+ * ==============
+ * The generator's solver (negamax with its transposition table) for other
+ * programs, so a bot or tool can keep one warm TT across many queries
+ * instead of starting a run per position. Build retrogradgen.c as an
+ * object with -DSOLVER_LIBRARY, which renames its main() to
+ * generator_main(), and link it with critical_db.c:
+ *
+ *   gcc -O3 -c -DSOLVER_LIBRARY [-DWIDTH=W -DHEIGHT=H] retrogradgen.c
+ *   gcc -O3 -o bot bot.c retrogradgen.o critical_db.o -lpthread
+ *
+ * The library solves the one board it was compiled for. Calls must not
+ * overlap: use it from one thread at a time. The same queries are served
+ * over stdin or a socket by ./generator --serve (see retrogradgen.c).
+ */
+#ifndef SOLVER_H
+#define SOLVER_H
+#include <stddef.h>
+#include <stdint.h>
+typedef struct {
+    int score;         /* Positive = side to move wins, larger = sooner */
+    int best_col;      /* 0-based column reaching score, -1 on a full board */
+    uint64_t nodes;    /* Nodes searched for this query */
+} SolverResult;
+/* Allocate the transposition table (tt_mb MB, 0 for the default); exits
+ * with a message if it cannot */
+void solver_init(size_t tt_mb);
+void solver_free(void);
+/* Solve the position after moves, a string of 1-based columns ("4453").
+ * Returns NULL, or why the string is not a position to solve. */
+const char *solver_solve_moves(const char *moves, SolverResult *out);
+/* Same for bitboards as in critical_db.h: current = the side to move's
+ * stones, mask = all stones */
+const char *solver_solve_bitboards(uint64_t current, uint64_t mask, SolverResult *out);
+#endif